@@ -27,10 +27,17 @@
 // OpenBSD Current Executable Path Name Implementation
 // Compile: clang++ main.cpp -o a.out -std=c++17 -lkvm
 // libkvm comes with OpenBSD; no additional dependency
+// Or: clang++ main.cpp -o a.out -std=c++17 -DLAZY_LIBKVM
+// which dlopen()s libkvm on first use and falls back to sysctl(2) when
+// it cannot be loaded or kvm_openfiles() fails; libkvm stays preferred
+// when it is there so both builds read the same interface ps(1) uses
 
 #include <string>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
 
 #include <cstdio>
 #include <cerrno>
@@ -42,41 +49,215 @@
 #include <sys/sysctl.h>
 #include <unistd.h>
 #include <kvm.h>
+#ifdef LAZY_LIBKVM
+#include <dlfcn.h>
+#endif
 
-std::string get_executable_path() {
+// the verified path the program was found under (which may be a symlink
+// such as /usr/local/bin/python3) plus its realpath(3), computed only on
+// the first call to canonical() and remembered after that; like any
+// std::string holder it is a value to copy, not to share: canonical()
+// writes the memo unguarded, so give each thread its own copy
+class executable_path_result {
+ public:
+  executable_path_result() = default;
+  explicit executable_path_result(std::string invoked) : invoked_path(invoked) {}
+  bool empty() const {
+    return invoked_path.empty();
+  }
+  const std::string &invoked() const {
+    return invoked_path;
+  }
+  bool canonicalized() const {
+    return !canonical_path.empty();
+  }
+  const std::string &canonical() const {
+    if (canonical_path.empty() && !invoked_path.empty()) {
+      char buffer[PATH_MAX];
+      if (realpath(invoked_path.c_str(), buffer)) {
+        canonical_path = buffer;
+      }
+    }
+    return canonical_path;
+  }
+ private:
+  std::string invoked_path;
+  mutable std::string canonical_path;
+};
+
+struct kvm_api {
+  kvm_t *(*openfiles)(const char *, const char *, const char *, int, char *);
+  int (*close)(kvm_t *);
+  struct kinfo_proc *(*getprocs)(kvm_t *, int, int, size_t, int *);
+  char **(*getargv)(kvm_t *, const struct kinfo_proc *, int);
+  struct kinfo_file *(*getfiles)(kvm_t *, int, int, size_t, int *);
+};
+
+// null when libkvm could not be loaded; with KVM_NO_FILES libkvm only
+// wraps the same sysctl(2) calls, which are used directly instead
+static const kvm_api *libkvm() {
+#ifdef LAZY_LIBKVM
+  static const kvm_api *api = []() -> const kvm_api * {
+    static kvm_api res;
+    void *handle = dlopen("libkvm.so", RTLD_LAZY | RTLD_LOCAL);
+    if (!handle) return nullptr;
+    res.openfiles = (decltype(res.openfiles))dlsym(handle, "kvm_openfiles");
+    res.close = (decltype(res.close))dlsym(handle, "kvm_close");
+    res.getprocs = (decltype(res.getprocs))dlsym(handle, "kvm_getprocs");
+    res.getargv = (decltype(res.getargv))dlsym(handle, "kvm_getargv");
+    res.getfiles = (decltype(res.getfiles))dlsym(handle, "kvm_getfiles");
+    if (!res.openfiles || !res.close || !res.getprocs || !res.getargv || !res.getfiles) {
+      dlclose(handle);
+      return nullptr;
+    }
+    return &res;
+  }();
+  return api;
+#else
+  static const kvm_api api = { kvm_openfiles, kvm_close, kvm_getprocs, kvm_getargv, kvm_getfiles };
+  return &api;
+#endif
+}
+
+// one session serves every fetch of a resolution; null when libkvm is
+// missing or kvm_openfiles() failed, and sysctl(2) answers instead
+static kvm_t *open_kvm() {
+  const kvm_api *kvm = libkvm();
+  return kvm ? kvm->openfiles(nullptr, nullptr, nullptr, KVM_NO_FILES, nullptr) : nullptr;
+}
+
+static void close_kvm(kvm_t *kd) {
+  if (kd) libkvm()->close(kd);
+}
+
+static bool fetch_text(kvm_t *kd, pid_t pid, dev_t *dev, ino_t *ino, std::string *comm) {
+  int cntp = 0;
+  bool found = false;
+  kinfo_file *kif = nullptr;
+  auto find_text = [&]() {
+    for (int i = 0; i < cntp && kif[i].fd_fd < 0; i++) {
+      if (kif[i].fd_fd == KERN_FILE_TEXT) {
+        *dev = (dev_t)kif[i].va_fsid;
+        *ino = (ino_t)kif[i].va_fileid;
+        *comm = kif[i].p_comm;
+        found = true;
+        break;
+      }
+    }
+  };
+  if (kd) {
+    if ((kif = libkvm()->getfiles(kd, KERN_FILE_BYPID, pid, sizeof(struct kinfo_file), &cntp))) {
+      find_text();
+    }
+  } else {
+    // the text, cwd, root and trace entries come before any descriptor
+    kinfo_file buffer[8];
+    int mib[6] = { CTL_KERN, KERN_FILE, KERN_FILE_BYPID, pid, sizeof(struct kinfo_file), 8 };
+    std::size_t len = sizeof(buffer);
+    if (sysctl(mib, 6, buffer, &len, nullptr, 0) == -1 && errno != ENOMEM) return false;
+    kif = buffer;
+    cntp = (int)(len / sizeof(struct kinfo_file));
+    find_text();
+  }
+  return found;
+}
+
+static bool fetch_argv0(kvm_t *kd, pid_t pid, std::string *argv0, std::string *comm) {
+  int cntp = 0;
+  bool found = false;
+  if (kd) {
+    const kvm_api *kvm = libkvm();
+    kinfo_proc *proc_info = nullptr;
+    if ((proc_info = kvm->getprocs(kd, KERN_PROC_PID, pid, sizeof(struct kinfo_proc), &cntp))) {
+      if (comm) *comm = proc_info->p_comm;
+      char **cmd = kvm->getargv(kd, proc_info, 0);
+      if (cmd && cmd[0]) {
+        *argv0 = cmd[0];
+        found = true;
+      }
+    }
+    return found;
+  }
+  if (comm) {
+    kinfo_proc proc_info;
+    int mib[6] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid, sizeof(struct kinfo_proc), 1 };
+    std::size_t len = sizeof(proc_info);
+    if (sysctl(mib, 6, &proc_info, &len, nullptr, 0) == -1 || !len) return false;
+    *comm = proc_info.p_comm;
+  }
+  std::vector<char> buffer(8192);
+  int mib[4] = { CTL_KERN, KERN_PROC_ARGS, pid, KERN_PROC_ARGV };
+  std::size_t len = buffer.size();
+  while (sysctl(mib, 4, buffer.data(), &len, nullptr, 0) == -1) {
+    if (errno != ENOMEM) return false;
+    buffer.resize(buffer.size() * 2);
+    len = buffer.size();
+  }
+  char **cmd = (char **)buffer.data();
+  if (len && cmd[0]) {
+    *argv0 = cmd[0];
+    found = true;
+  }
+  return found;
+}
+
+// the text vnode never changes for the life of the process image, so
+// it is fetched from the kernel once and only a success is remembered;
+// kd and pid are the caller's session and pid, or null and 0 to open
+// and look them up only when nothing is cached yet
+static bool text_identity(kvm_t *kd, pid_t pid, dev_t *dev, ino_t *ino, std::string *comm) {
+  // the values are written once, before ready is released, so readers
+  // only take mtx until the first successful fetch
+  static std::mutex mtx;
+  static std::atomic<bool> ready(false);
+  static dev_t cached_dev = 0;
+  static ino_t cached_ino = 0;
+  static std::string cached_comm;
+  if (!ready.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!ready.load(std::memory_order_relaxed)) {
+      kvm_t *own_kd = kd ? nullptr : open_kvm();
+      if (fetch_text(kd ? kd : own_kd, pid ? pid : getpid(), &cached_dev, &cached_ino, &cached_comm)) {
+        ready.store(true, std::memory_order_release);
+      }
+      close_kvm(own_kd);
+      if (!ready.load(std::memory_order_relaxed)) return false;
+    }
+  }
+  if (dev) *dev = cached_dev;
+  if (ino) *ino = cached_ino;
+  if (comm) *comm = cached_comm;
+  return true;
+}
+
+static std::string executable_path(bool verified) {
   std::string path;
-  auto is_exe = [](std::string exe) {
-    int cntp = 0;
+  dev_t text_dev = 0;
+  ino_t text_ino = 0;
+  std::string text_comm;
+  std::vector<std::string> probed;
+  auto is_exe = [&](std::string exe) {
     std::string res;
-    kvm_t *kd = nullptr;
-    kinfo_file *kif = nullptr;
+    struct stat st;
     bool error = false;
-    kd = kvm_openfiles(nullptr, nullptr, nullptr, KVM_NO_FILES, nullptr);
-    if (!kd) return res;
-    if ((kif = kvm_getfiles(kd, KERN_FILE_BYPID, getpid(), sizeof(struct kinfo_file), &cntp))) {
-      for (int i = 0; i < cntp && kif[i].fd_fd < 0; i++) {
-        if (kif[i].fd_fd == KERN_FILE_TEXT) {
-          struct stat st;
-          fallback:
-          char buffer[PATH_MAX];
-          if (!stat(exe.c_str(), &st) && (st.st_mode & S_IXUSR) &&
-            (st.st_mode & S_IFREG) && realpath(exe.c_str(), buffer) &&
-            st.st_dev == (dev_t)kif[i].va_fsid && st.st_ino == (ino_t)kif[i].va_fileid) {
-            res = buffer;
-          }
-          if (res.empty() && !error) {
-            error = true;
-            std::size_t last_slash_pos = exe.find_last_of("/");
-            if (last_slash_pos != std::string::npos) {
-              exe = exe.substr(0, last_slash_pos + 1) + kif[i].p_comm;
-              goto fallback;
-            }
-          }
-          break;
-        }
+    fallback:
+    // every candidate probed so far missed, so never stat(2) one twice;
+    // $PATH, the default PATH, the p_comm retry and $_ often overlap
+    if (std::find(probed.begin(), probed.end(), exe) == probed.end()) {
+      probed.push_back(exe);
+      if (!stat(exe.c_str(), &st) && (st.st_mode & S_IXUSR) && S_ISREG(st.st_mode) &&
+        (!verified || (st.st_dev == text_dev && st.st_ino == text_ino))) {
+        res = exe;
+      }
+    }
+    if (res.empty() && !error) {
+      error = true;
+      std::size_t last_slash_pos = exe.find_last_of("/");
+      if (last_slash_pos != std::string::npos) {
+        exe = exe.substr(0, last_slash_pos + 1) + text_comm;
+        goto fallback;
       }
     }
-    kvm_close(kd);
     return res;
   };
   auto cppstr_getenv = [](std::string name) {
@@ -84,49 +265,52 @@ std::string get_executable_path() {
     std::string result = cresult ? cresult : "";
     return result;
   };
-  int cntp = 0;
-  kvm_t *kd = nullptr;
-  kinfo_proc *proc_info = nullptr;
+  auto classify_argv0 = [](std::string arg) {
+    // login shells run as "-ksh"; privsep daemons and setproctitle(3)
+    // rewrite argv0 as "smtpd: queue" or "ntpd: dns engine"
+    if (!arg.empty() && arg[0] == '-') arg.erase(0, 1);
+    std::size_t sep_pos = arg.find_first_of(": ");
+    if (sep_pos != std::string::npos && sep_pos > 0 && sep_pos < arg.find('/')) {
+      arg.erase(sep_pos);
+    }
+    return arg;
+  };
   std::vector<std::string> buffer;
+  std::string cmd0;
+  pid_t pid = getpid();
   bool error = false, retried = false;
-  kd = kvm_openfiles(nullptr, nullptr, nullptr, KVM_NO_FILES, nullptr);
-  if (!kd) {
+  // fetch argv and (on the first call) the text vnode identity in one
+  // kvm session, then probe candidates with stat(2) alone
+  kvm_t *kd = open_kvm();
+  if (verified && !text_identity(kd, pid, &text_dev, &text_ino, &text_comm)) {
+    close_kvm(kd);
     path.clear();
     return path;
   }
-  if ((proc_info = kvm_getprocs(kd, KERN_PROC_PID, getpid(), sizeof(struct kinfo_proc), &cntp))) {
-    char **cmd = kvm_getargv(kd, proc_info, 0);
-    if (cmd) {
-      for (int i = 0; cmd[i]; i++) {
-        buffer.push_back(cmd[i]);
-      }
-    }
+  if (fetch_argv0(kd, pid, &cmd0, verified ? nullptr : &text_comm)) {
+    buffer.push_back(cmd0);
   }
-  kvm_close(kd);
+  close_kvm(kd);
   if (!buffer.empty()) {
-    std::string argv0;
+    std::string argv0, name;
     if (!buffer[0].empty()) {
       fallback:
-      std::size_t slash_pos = buffer[0].find('/');
-      std::size_t colon_pos = buffer[0].find(':');
+      name = classify_argv0(buffer[0]);
+      probe:
+      std::size_t slash_pos = name.find('/');
       if (slash_pos == 0) {
-        argv0 = buffer[0];
+        argv0 = name;
         path = is_exe(argv0);
-      } else if (slash_pos == std::string::npos || slash_pos > colon_pos) { 
+      } else if (slash_pos == std::string::npos) {
         std::string penv = cppstr_getenv("PATH");
         if (!penv.empty()) {
           retry:
           std::string tmp;
           std::stringstream sstr(penv);
           while (std::getline(sstr, tmp, ':')) {
-            argv0 = tmp + "/" + buffer[0];
+            argv0 = tmp + "/" + name;
             path = is_exe(argv0);
             if (!path.empty()) break;
-            if (slash_pos > colon_pos) {
-              argv0 = tmp + "/" + buffer[0].substr(0, colon_pos);
-              path = is_exe(argv0);
-              if (!path.empty()) break;
-            }
           }
         }
         if (path.empty() && !retried) {
@@ -142,17 +326,22 @@ std::string get_executable_path() {
       if (path.empty() && slash_pos > 0) {
         std::string pwd = cppstr_getenv("PWD");
         if (!pwd.empty()) {
-          argv0 = pwd + "/" + buffer[0];
+          argv0 = pwd + "/" + name;
           path = is_exe(argv0);
         }
         if (path.empty()) {
           char cwd[PATH_MAX];
           if (getcwd(cwd, PATH_MAX)) {
-            argv0 = std::string(cwd) + "/" + buffer[0];
+            argv0 = std::string(cwd) + "/" + name;
             path = is_exe(argv0);
           }
         }
       }
+      if (path.empty() && name != buffer[0]) {
+        name = buffer[0];
+        retried = false;
+        goto probe;
+      }
     }
     if (path.empty() && !error) {
       error = true;
@@ -164,12 +353,89 @@ std::string get_executable_path() {
       }
     }
   }
+  if (!path.empty() && path[0] != '/') {
+    // a relative PATH entry only means something in the current cwd
+    char cwd_path[PATH_MAX];
+    path = realpath(path.c_str(), cwd_path) ? cwd_path : "";
+  }
   if (!path.empty()) {
     errno = 0;
   }
   return path;
 }
 
+bool is_current_executable(const std::string &path) {
+  struct stat st;
+  dev_t text_dev = 0;
+  ino_t text_ino = 0;
+  if (!text_identity(nullptr, 0, &text_dev, &text_ino, nullptr)) return false;
+  return (!stat(path.c_str(), &st) && S_ISREG(st.st_mode) &&
+    st.st_dev == text_dev && st.st_ino == text_ino);
+}
+
+static std::mutex last_result_mtx;
+static executable_path_result last_result;
+// bumped whenever last_result is replaced so each thread's copy of it
+// can be trusted without taking last_result_mtx
+static std::atomic<unsigned long> last_result_generation(0);
+
+executable_path_result get_executable_path_result() {
+  // while the last result still names the running text, a single
+  // stat(2) replaces the whole kvm fetch and candidate search
+  thread_local unsigned long local_generation = 0;
+  thread_local executable_path_result local_result;
+  if (!local_generation || local_generation != last_result_generation.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(last_result_mtx);
+    local_result = last_result;
+    local_generation = last_result_generation.load(std::memory_order_relaxed);
+  }
+  if (!local_result.empty() && is_current_executable(local_result.invoked())) {
+    errno = 0;
+    return local_result;
+  }
+  executable_path_result res(executable_path(true));
+  if (!res.empty()) {
+    std::lock_guard<std::mutex> lock(last_result_mtx);
+    last_result = res;
+    last_result_generation.fetch_add(1, std::memory_order_release);
+  }
+  return res;
+}
+
+std::string get_executable_path() {
+  executable_path_result res = get_executable_path_result();
+  if (!res.empty() && !res.canonicalized() && !res.canonical().empty()) {
+    std::lock_guard<std::mutex> lock(last_result_mtx);
+    if (last_result.invoked() == res.invoked() && !last_result.canonicalized()) {
+      last_result = res;
+      last_result_generation.fetch_add(1, std::memory_order_release);
+    }
+  }
+  return res.canonical();
+}
+
+// best effort: the first executable regular file in the usual search
+// order, not checked against the kernel's text vnode; may be wrong.
+// A verified result left by an earlier call is cheaper and exact, so
+// it is returned as is when there is one
+std::string get_executable_path_unverified() {
+  executable_path_result res;
+  {
+    std::lock_guard<std::mutex> lock(last_result_mtx);
+    res = last_result;
+  }
+  if (!res.empty()) {
+    errno = 0;
+  } else {
+    res = executable_path_result(executable_path(false));
+  }
+  return res.canonical();
+}
+
+bool get_executable_identity(dev_t *dev, ino_t *ino) {
+  return text_identity(nullptr, 0, dev, ino, nullptr);
+}
+
 int main() {
   std::string exe = get_executable_path();
   bool failed = exe.empty();